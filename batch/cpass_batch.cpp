@@ -0,0 +1,304 @@
+/* cpass-batch runs the StorePropagation pipeline over many modules in a
+ * single process. It exists for large corpora, where starting one opt
+ * process per input and round-tripping through textual IR costs more than
+ * the pass itself.
+ *
+ *   cpass-batch -j 8 -o out/ ir/unopt/ more.bc ...
+ *
+ * Inputs may be .bc or .ll files or directories containing them. Each module
+ * is loaded into its own LLVMContext on a worker thread, so modules are
+ * processed independently and output is written as bitcode.
+ */
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+/* Provided by store_prop.cpp, which is linked into this tool. */
+extern "C" PassPluginLibraryInfo llvmGetPassPluginInfo();
+
+static cl::list<string> InputPaths(cl::Positional, cl::OneOrMore,
+    cl::desc("<input .bc/.ll files or directories>"));
+
+static cl::opt<string> OutputDir("o", cl::value_desc("dir"),
+    cl::desc("Directory to write optimized bitcode to (none: do not write)"),
+    cl::init(""));
+
+static cl::opt<unsigned> Jobs("j", cl::value_desc("N"),
+    cl::desc("Number of modules to process in parallel (0: all cores)"),
+    cl::init(0));
+
+static cl::opt<string> FunctionPasses("passes",
+    cl::desc("Function pipeline run on each function that contains stores"),
+    cl::init("store-prop"));
+
+static cl::opt<bool> RemoveOptNone("remove-optnone",
+    cl::desc("Run remove-optnone on each module first"), cl::init(true));
+
+static cl::opt<bool> Verify("verify",
+    cl::desc("Verify each module after optimization"), cl::init(true));
+
+struct ModuleStats {
+    string   name;
+    bool     ok          = false;
+    unsigned nr_funcs    = 0;
+    unsigned nr_run      = 0;
+    unsigned insts_in    = 0;
+    unsigned insts_out   = 0;
+    unsigned loads_in    = 0;
+    unsigned loads_out   = 0;
+    double   seconds     = 0.0;
+};
+
+static void countInsts(Module &M, unsigned &insts, unsigned &loads)
+{
+    insts = loads = 0;
+    for (Function &F : M) {
+        for (Instruction &I : instructions(F)) {
+            insts++;
+            if (isa<LoadInst>(&I))
+                loads++;
+        }
+    }
+}
+
+static bool hasStore(Function &F)
+{
+    for (Instruction &I : instructions(F))
+        if (isa<StoreInst>(&I))
+            return true;
+    return false;
+}
+
+/*
+ * collectInputs expands directories in the command line into the .bc and .ll
+ * files they contain (non-recursively).
+ */
+static vector<string> collectInputs()
+{
+    vector<string> files;
+    for (const string &path : InputPaths) {
+        if (!sys::fs::is_directory(path)) {
+            files.push_back(path);
+            continue;
+        }
+
+        error_code EC;
+        for (sys::fs::directory_iterator it(path, EC), end; it != end && !EC;
+             it.increment(EC)) {
+            StringRef ext = sys::path::extension(it->path());
+            if (ext == ".bc" || ext == ".ll")
+                files.push_back(it->path());
+        }
+        if (EC)
+            errs() << "cpass-batch: " << path << ": " << EC.message() << "\n";
+    }
+    return files;
+}
+
+/*
+ * outputPath names the bitcode file written for input path under -o.
+ */
+static string outputPath(StringRef path)
+{
+    SmallString<256> out(OutputDir);
+    sys::path::append(out, sys::path::stem(path) + ".bc");
+    return string(out.str());
+}
+
+/*
+ * processModule loads, optimizes and writes a single module. Everything here
+ * is thread-local: the context, the PassBuilder and its analysis managers.
+ *
+ * The function pipeline only runs on functions that contain a store;
+ * functions without stores have nothing to forward and are left alone. The
+ * module is parsed eagerly: finding out whether a function has a store
+ * needs its body, and the instruction counts need every body, so a lazy
+ * loader would end up materializing everything anyway.
+ */
+static ModuleStats processModule(const string &path)
+{
+    ModuleStats stats;
+    stats.name = path;
+
+    auto start = chrono::steady_clock::now();
+
+    LLVMContext Ctx;
+    SMDiagnostic Err;
+    unique_ptr<Module> M = parseIRFile(path, Err, Ctx);
+    if (!M) {
+        string msg;
+        raw_string_ostream rso(msg);
+        Err.print("cpass-batch", rso);
+        errs() << rso.str();
+        return stats;
+    }
+
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+
+    PassBuilder PB;
+    llvmGetPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    FunctionPassManager FPM;
+    if (Error E = PB.parsePassPipeline(FPM, FunctionPasses)) {
+        errs() << "cpass-batch: " << toString(std::move(E)) << "\n";
+        return stats;
+    }
+
+    vector<Function*> work;
+    for (Function &F : *M) {
+        if (F.isDeclaration())
+            continue;
+        stats.nr_funcs++;
+        if (hasStore(F))
+            work.push_back(&F);
+    }
+
+    countInsts(*M, stats.insts_in, stats.loads_in);
+
+    if (RemoveOptNone) {
+        ModulePassManager MPM;
+        cantFail(PB.parsePassPipeline(MPM, "remove-optnone"));
+        MPM.run(*M, MAM);
+    }
+
+    for (Function *F : work) {
+        FPM.run(*F, FAM);
+        stats.nr_run++;
+    }
+
+    countInsts(*M, stats.insts_out, stats.loads_out);
+
+    if (Verify && verifyModule(*M, &errs())) {
+        errs() << "cpass-batch: " << path << ": broken module after pass\n";
+        return stats;
+    }
+
+    if (!OutputDir.empty()) {
+        string out = outputPath(path);
+
+        error_code EC;
+        raw_fd_ostream os(out, EC, sys::fs::OF_None);
+        if (EC) {
+            errs() << "cpass-batch: " << out << ": " << EC.message() << "\n";
+            return stats;
+        }
+        WriteBitcodeToFile(*M, os);
+    }
+
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                             start).count();
+    stats.ok = true;
+    return stats;
+}
+
+static void printStats(const ModuleStats &s)
+{
+    double rate = s.seconds > 0 ? s.insts_in / s.seconds : 0.0;
+    outs() << format("%-40s %5u/%-5u fns %8u -> %-8u insts %7u -> %-7u loads "
+                     "%9.3f ms %12.0f insts/s\n",
+                     s.name.c_str(), s.nr_run, s.nr_funcs, s.insts_in,
+                     s.insts_out, s.loads_in, s.loads_out, s.seconds * 1e3,
+                     rate);
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "StorePropagation batch driver\n");
+
+    if (!OutputDir.empty()) {
+        if (error_code EC = sys::fs::create_directories(OutputDir)) {
+            errs() << "cpass-batch: " << OutputDir << ": " << EC.message()
+                   << "\n";
+            return 1;
+        }
+    }
+
+    vector<string> files = collectInputs();
+
+    /* Outputs are named by the input's stem, so a.ll and a.bc, or a.ll in
+     * two directories, would be written to the same file from two threads.
+     */
+    if (!OutputDir.empty()) {
+        StringMap<string> writers;
+        bool clash = false;
+        for (const string &path : files) {
+            auto it = writers.try_emplace(outputPath(path), path);
+            if (!it.second) {
+                errs() << "cpass-batch: " << path << " and "
+                       << it.first->second << " would both be written to "
+                       << it.first->first() << "\n";
+                clash = true;
+            }
+        }
+        if (clash)
+            return 1;
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    ModuleStats sum;
+    unsigned nr_failed = 0;
+    std::mutex lock;
+
+    ThreadPool pool(hardware_concurrency(Jobs));
+    for (const string &path : files) {
+        pool.async([&, path] {
+            ModuleStats s = processModule(path);
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (!s.ok) {
+                nr_failed++;
+                return;
+            }
+            printStats(s);
+            sum.nr_funcs  += s.nr_funcs;
+            sum.nr_run    += s.nr_run;
+            sum.insts_in  += s.insts_in;
+            sum.insts_out += s.insts_out;
+            sum.loads_in  += s.loads_in;
+            sum.loads_out += s.loads_out;
+        });
+    }
+    pool.wait();
+
+    sum.name = "total (" + to_string(files.size() - nr_failed) + " modules)";
+    sum.seconds = chrono::duration<double>(chrono::steady_clock::now() -
+                                           start).count();
+    printStats(sum);
+
+    return nr_failed ? 1 : 0;
+}
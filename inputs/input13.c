@@ -0,0 +1,25 @@
+#include <stdio.h>
+
+int main() {
+  int i, sum, done;
+
+  done = 0;
+  i = 0;
+  sum = 0;
+
+  do {
+    sum = sum + i;
+    i = i + 1;
+  } while (done);
+
+  while (i < 6) {
+    sum = sum + i;
+    i = i + 1;
+    if (done)
+      i = 0;
+  }
+
+  printf("%d %d\n", i, sum);
+
+  return 0;
+}
@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+#ifndef FLAG
+#define FLAG 0
+#endif
+
+static const int flag = FLAG;
+
+int f() {
+  int a;
+
+  a = 1;
+  if (flag)
+    a = 2;
+  return a;
+}
+
+int main() {
+  printf("%d\n", f());
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+#!/usr/bin/env bash
+#
+# load_report.sh compares the dynamic load counts of an unoptimized and an
+# optimized run of the same program, both built with the store-prop-instrument
+# pass (see "make profile"). It prints the loads executed in each build and
+# how many store-prop eliminated, per function and per source line, largest
+# first. Lines are only known for inputs compiled with -g.
+#
+# Usage: scripts/load_report.sh UNOPT_PROFILE OPT_PROFILE [TOP]
+#
+# TOP (default 20) limits the number of rows in each table.
+
+set -u
+
+if [ $# -lt 2 ]; then
+    echo "usage: $0 UNOPT_PROFILE OPT_PROFILE [TOP]" >&2
+    exit 2
+fi
+
+UNOPT=$1
+OPT=$2
+TOP=${3:-20}
+
+for prof in "$UNOPT" "$OPT"; do
+    if [ ! -r "$prof" ]; then
+        echo "$0: cannot read $prof" >&2
+        exit 1
+    fi
+done
+
+# Profile lines are "<load|store> <function> <file> <line> <count>".
+# Prints "<key> <unopt> <opt>" for the loads, where the key is the function
+# (fn) or the source line (line).
+aggregate() {
+    awk -v key="$1" '
+        $1 != "load" { next }
+        {
+            k = key == "fn" ? $2 : $3 ":" $4
+            if (FILENAME == ARGV[1]) unopt[k] += $5; else opt[k] += $5
+            seen[k] = 1
+        }
+        END { for (k in seen) print k, unopt[k] + 0, opt[k] + 0 }
+    ' "$UNOPT" "$OPT"
+}
+
+table() {
+    printf "%-40s %14s %14s %14s %7s\n" "$1" unopt opt eliminated "%"
+    aggregate "$2" | awk '{ print $0, $2 - $3 }' | sort -k4,4nr -k1,1 |
+        head -n "$TOP" |
+        awk '{
+            pct = $2 ? 100 * $4 / $2 : 0
+            printf "%-40s %14d %14d %14d %6.1f%%\n", $1, $2, $3, $4, pct
+        }'
+    echo
+}
+
+table "loads by function" fn
+table "loads by source line" line
+
+awk '
+    FILENAME == ARGV[1] { u[$1] += $5; next }
+    { o[$1] += $5 }
+    END {
+        printf "total: %d -> %d loads (%d eliminated), %d -> %d stores\n",
+               u["load"], o["load"], u["load"] - o["load"],
+               u["store"], o["store"]
+    }
+' "$UNOPT" "$OPT"
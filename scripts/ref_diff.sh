@@ -0,0 +1,173 @@
+#!/usr/bin/env bash
+#
+# ref_diff.sh compares the StorePropagation plugin against the reference
+# plugin in ref_lib. Every input in inputs/ and a corpus of llvm-stress
+# modules is optimized with both plugins. For each function it compares the
+# number of loads, stores and instructions left over. It also checks that
+# the optimized programs print the same output as the unoptimized ones, and
+# compares how long each plugin takes to compile.
+#
+# The script exits non-zero if any function is optimized worse than by the
+# reference, if an optimized program misbehaves, or if the total compile
+# time is more than TIME_TOLERANCE times the reference.
+#
+# Usage: scripts/ref_diff.sh   (see the variables below for overrides)
+
+set -u
+
+OPT_SO=${OPT_SO:-build/store_prop/libstore_prop.so}
+REF_OPT_SO=${REF_OPT_SO:-ref_lib/libstore_prop.so}
+PASSES=${PASSES:-'default<O0>,module(remove-optnone),function(store-prop)'}
+INPUTS_DIR=${INPUTS_DIR:-inputs}
+WORK_DIR=${WORK_DIR:-build/ref_diff}
+NR_STRESS=${NR_STRESS:-50}        # number of generated modules
+STRESS_SIZE=${STRESS_SIZE:-200}   # instructions per generated module
+NR_RUNS=${NR_RUNS:-3}             # timing runs per module (best is kept)
+TIME_TOLERANCE=${TIME_TOLERANCE:-1.25}
+TIME_SLACK_MS=${TIME_SLACK_MS:-50}
+
+fail=0
+opt_ms=0
+ref_ms=0
+
+die() {
+    echo "ref_diff: $*" >&2
+    exit 2
+}
+
+now_ns() {
+    date +%s%N
+}
+
+# run_opt <plugin> <in.ll> <out.ll> prints the best wall time in ms.
+run_opt() {
+    local best=-1 t0 t1 ms i
+    for ((i = 0; i < NR_RUNS; i++)); do
+        t0=$(now_ns)
+        opt -load-pass-plugin "$1" -passes="$PASSES" -S "$2" -o "$3" \
+            2> "$3.err" || return 1
+        t1=$(now_ns)
+        ms=$(( (t1 - t0) / 1000000 ))
+        if (( best < 0 || ms < best )); then
+            best=$ms
+        fi
+    done
+    echo "$best"
+}
+
+# count_ir <file.ll> prints "function loads stores insts" per definition.
+count_ir() {
+    awk '
+        /^define / {
+            match($0, /@[-a-zA-Z$._0-9"]+/)
+            fn = substr($0, RSTART + 1, RLENGTH - 1)
+            loads = stores = insts = 0
+            next
+        }
+        fn != "" && /^}/ {
+            print fn, loads, stores, insts
+            fn = ""
+            next
+        }
+        fn != "" && /^  [^ ;]/ {
+            insts++
+            if ($0 ~ /= load /)  loads++
+            if ($0 ~ /^  store /) stores++
+        }
+    ' "$1"
+}
+
+# compare_counts <name> <opt.ll> <ref.ll> reports functions where opt is
+# worse than ref.
+compare_counts() {
+    local name=$1
+    join <(count_ir "$2" | sort) <(count_ir "$3" | sort) |
+    while read -r fn ol os oi rl rs ri; do
+        if (( ol > rl || os > rs || oi > ri )); then
+            printf '%-24s %-24s loads %d/%d stores %d/%d insts %d/%d\n' \
+                "$name" "$fn" "$ol" "$rl" "$os" "$rs" "$oi" "$ri"
+        fi
+    done
+}
+
+# run_ll <file.ll> runs a module with lli and prints its output and status.
+run_ll() {
+    lli "$1" 2>&1
+    echo "exit $?"
+}
+
+command -v opt > /dev/null || die "opt not found"
+[ -f "$OPT_SO" ] || die "$OPT_SO not found (run make first)"
+[ -f "$REF_OPT_SO" ] || die "$REF_OPT_SO not found"
+
+mkdir -p "$WORK_DIR"/unopt "$WORK_DIR"/opt "$WORK_DIR"/ref_opt
+
+# Make sure the reference plugin loads with this opt before timing anything.
+echo 'define void @f() { ret void }' |
+    opt -load-pass-plugin "$REF_OPT_SO" -passes="$PASSES" -disable-output \
+    || die "$REF_OPT_SO cannot be loaded by $(command -v opt)"
+
+# Collect the unoptimized corpus.
+runnable=()
+if command -v clang > /dev/null; then
+    for src in "$INPUTS_DIR"/*.c; do
+        name=$(basename "$src" .c)
+        clang -S -emit-llvm -O0 "$src" -o "$WORK_DIR/unopt/$name.ll" ||
+            die "cannot compile $src"
+        runnable+=("$name")
+    done
+else
+    echo "ref_diff: clang not found, skipping $INPUTS_DIR" >&2
+fi
+
+for ((i = 0; i < NR_STRESS; i++)); do
+    llvm-stress -seed="$i" -size="$STRESS_SIZE" \
+        -o "$WORK_DIR/unopt/stress$i.ll" || die "llvm-stress failed"
+done
+
+printf '%-24s %-24s %s\n' module function "opt/ref counts"
+for ll in "$WORK_DIR"/unopt/*.ll; do
+    name=$(basename "$ll" .ll)
+    out="$WORK_DIR/opt/$name.ll"
+    ref="$WORK_DIR/ref_opt/$name.ll"
+
+    if ! ms=$(run_opt "$OPT_SO" "$ll" "$out"); then
+        echo "$name: opt failed:"; cat "$out.err"; fail=1; continue
+    fi
+
+    # Only modules both plugins handle count towards compile time.
+    if ! rms=$(run_opt "$REF_OPT_SO" "$ll" "$ref"); then
+        echo "$name: reference failed, skipped"; continue
+    fi
+    opt_ms=$((opt_ms + ms))
+    ref_ms=$((ref_ms + rms))
+
+    worse=$(compare_counts "$name" "$out" "$ref")
+    if [ -n "$worse" ]; then
+        echo "$worse"
+        fail=1
+    fi
+done
+
+# The optimized inputs must behave like the unoptimized ones.
+for name in "${runnable[@]}"; do
+    expect=$(run_ll "$WORK_DIR/unopt/$name.ll")
+    if [ "$(run_ll "$WORK_DIR/opt/$name.ll")" != "$expect" ]; then
+        echo "$name: output differs from unoptimized build"
+        fail=1
+    fi
+done
+
+echo "compile time: opt ${opt_ms} ms, ref ${ref_ms} ms"
+if awk -v o="$opt_ms" -v r="$ref_ms" -v t="$TIME_TOLERANCE" \
+       -v s="$TIME_SLACK_MS" 'BEGIN { exit !(o > r * t + s) }'; then
+    echo "compile time regression (tolerance ${TIME_TOLERANCE}x)"
+    fail=1
+fi
+
+if (( fail )); then
+    echo "ref_diff: FAILED"
+else
+    echo "ref_diff: OK"
+fi
+exit $fail
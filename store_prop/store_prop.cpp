@@ -3,19 +3,42 @@
 #include "llvm/Passes/PassPlugin.h"
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/InstIterator.h"
 
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ConstantFolding.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/ValueMap.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/ScopedHashTable.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/Support/Format.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/ADT/SmallString.h"
 
 #include <map>
+#include <memory>
 #include <vector>
 #include <string>
 #include <set>
 #include <queue>
+#include <algorithm>
+#include <atomic>
 
 #define SRC_IDX 0
 #define DST_IDX 1
@@ -23,7 +46,108 @@
 using namespace llvm;
 using namespace std;
 
-typedef map<Value*, Value*> ACPTable;
+/* An ACPLayer maps each location to the copy (store or argument) that makes
+ * its value available. Layers are immutable once built and shared: a layer
+ * only records how it differs from its parent, so blocks with equal CPIn sets
+ * share one layer and blocks with nearly equal CPIn sets share most of one.
+ * A null copy records that an entry of the parent is no longer available.
+ */
+struct ACPLayer {
+    std::shared_ptr<const ACPLayer> parent;
+    std::map<Value*, Value*> entries;
+    unsigned depth;
+};
+
+class EscapeInfo;
+
+/* ACPTable is the available copy table for one block: a shared, read-only
+ * base plus the updates made while propagating through the block. Copies
+ * are resolved to their current source operand on lookup rather than when
+ * the table is built, so loads erased by earlier blocks never leak out of a
+ * shared layer.
+ *
+ * As in domStorePropagation, a call does not remove entries: it starts a new
+ * memory generation, and an entry made in an older generation (every base
+ * entry is from generation 0) is only valid for a location the call cannot
+ * reach. A kill is therefore constant time however large the table is.
+ */
+class ACPTable {
+    struct LocalEntry {
+        Value   *copy;
+        unsigned gen;
+    };
+
+    /* loc null: a kill, and entry.gen is the generation before it. */
+    struct UndoEntry {
+        Value     *loc;
+        LocalEntry entry;
+        bool       existed;
+    };
+
+    std::shared_ptr<const ACPLayer> base;
+    std::map<Value*, LocalEntry> local;
+    std::vector<UndoEntry> undo_log;
+    unsigned gen = 0;
+    unsigned last_gen = 0;
+    const EscapeInfo *escapes = nullptr;  // of the last kill
+
+    bool isLive(Value *loc, unsigned entry_gen) const;
+
+  public:
+    ACPTable() {}
+    explicit ACPTable(std::shared_ptr<const ACPLayer> b) : base(std::move(b)) {}
+
+    Value *findCopy(Value *loc) const;
+    Value *lookup(Value *loc) const;
+    void insert(Value *loc, Value *copy);
+    void killClobbered(const EscapeInfo &escapes);
+    std::map<Value*, Value*> flatten() const;
+
+    /* Scoped undo: undo(mark()) drops every insert and kill made after the
+     * mark.
+     */
+    size_t mark() const { return undo_log.size(); }
+    void undo(size_t m);
+};
+
+static Value *resolveCopy(Value *loc, Value *copy);
+
+/* EscapeInfo classifies the locations copies write to, so that a call only
+ * kills the copies it can actually reach:
+ *
+ *   Private - an alloca whose address is only loaded from and stored to
+ *   Escaped - an alloca whose address is passed, stored or converted
+ *   Unknown - anything else (globals, pointer arguments, ...)
+ *
+ * Memory that is neither Escaped nor Unknown cannot be written by a call.
+ *
+ * A private alloca is also direct if no pointer is derived from it (by GEP,
+ * cast, select or phi): the alloca itself is then the only pointer to its
+ * memory, so keying copies by the pointer Value cannot miss an alias.
+ */
+class EscapeInfo {
+  public:
+    enum Kind { Private, Escaped, Unknown };
+
+    void analyze(Function &F, bool enabled);
+    Kind classify(Value *loc) const;
+    bool mayClobber(Value *loc) const { return classify(loc) != Private; }
+    bool isDirect(Value *loc) const;
+
+  private:
+    DenseMap<const AllocaInst*, bool> escaped;
+    SmallPtrSet<const AllocaInst*, 16> direct;
+    bool enabled = false;
+};
+
+/* isClobber returns true if I may write memory other than by a store, i.e.
+ * through a call or an intrinsic, and so kills copies to locations that
+ * EscapeInfo says it can reach.
+ */
+static bool isClobber(Instruction *I)
+{
+    return !isa<StoreInst>(I) && I->mayWriteToMemory();
+}
 
 class BasicBlockInfo {
   public:
@@ -32,6 +156,8 @@ class BasicBlockInfo {
     BitVector CPIn;
     BitVector CPOut;
     ACPTable  ACP;
+    bool      hasACP = false;
+    std::shared_ptr<const ACPLayer> ACPBase;
     
     BasicBlockInfo(unsigned int max_copies)
     {
@@ -48,14 +174,83 @@ class BasicBlockInfo {
 };
 
 namespace {
+/* How far propagation looks beyond a single block. */
+enum PropTier {
+	TierLocal,   // each block on its own (Muchnick LSP)
+	TierEBB,     // along extended basic blocks, no data-flow analysis
+	TierGlobal,  // LSP followed by the global data-flow phase (GSP)
+	TierDomTree, // scoped walk of the dominator tree, no data-flow analysis
+};
+
 struct StorePropagation : public PassInfoMixin<StorePropagation> {
 private:
+	void propagate(Function &F);
 	void localStorePropagation(Function &F);
+	void ebbStorePropagation(Function &F);
+	void domStorePropagation(Function &F);
+	void loopStorePropagation(Function &F);
+	bool promoteLocation(Loop *L, AllocaInst *AI);
 	void globalStorePropagation(Function &F);
+	bool foldConstants(Function &F);
 	void propagateStores(BasicBlock &bb, ACPTable &acp);
+	bool worthForwarding(Value *v, LoadInst *load);
+	bool mayForward(Value *loc) const
+	{
+		return !directOnly || escapes.isDirect(loc);
+	}
+	void forwardLoad(LoadInst *load, Value *copy, Value *known);
+
+	std::string cacheKey(Function &F);
+	void numberInstructions(Function &F);
+	void cacheNumber(Instruction *I);
+	bool replayCache(Function &F, StringRef log);
+
+	LoopInfo *loops = nullptr;
+	EscapeInfo escapes;
+	bool directOnly;
+	unsigned nr_kept = 0;
+
+	/* What the current run has changed: forwardLoad, operand rewrites,
+	 * promoteLocation, foldConstants and cache replay set ir_changed, and
+	 * foldConstants sets cfg_changed when it prunes a branch. preserved
+	 * turns them into the analyses the run keeps valid.
+	 */
+	bool ir_changed = false;
+	bool cfg_changed = false;
+	PreservedAnalyses preserved() const;
+
+	/* Analysis cache state for the current function: its instructions in
+	 * their original order, which name loads and stores in the rewrite log,
+	 * and the log being recorded on a miss.
+	 */
+	std::vector<WeakVH> cache_insts;
+	DenseMap<Value*, unsigned> cache_ids;
+	std::string cache_log;
+	bool recording = false;
 
 public:
+	/* Copies are keyed by the identical pointer Value, which is only sound
+	 * while distinct pointers do not alias, as in -O0 code. At the default
+	 * pipeline extension points that no longer holds, so there the pass is
+	 * created with directOnly and only forwards direct allocas (see
+	 * EscapeInfo).
+	 */
+	explicit StorePropagation(bool directOnly = false)
+	    : directOnly(directOnly) {}
+
 	static cl::opt<bool> verbose;
+	static cl::opt<bool> pipelineEP;
+	static cl::opt<bool> costModel;
+	static cl::opt<unsigned> maxLiveDistance;
+	static cl::opt<unsigned> maxCallsCrossed;
+	static cl::opt<bool> constFold;
+	static cl::opt<unsigned> maxFoldRounds;
+	static cl::opt<PropTier> tier;
+	static cl::opt<unsigned> dfaLimit;
+	static cl::opt<bool> escapeAnalysis;
+	static cl::opt<bool> loopPromotion;
+	static cl::opt<std::string> cacheDir;
+	static cl::opt<bool> cacheStats;
 	PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM);
 };
 
@@ -64,14 +259,446 @@ cl::opt<bool> StorePropagation::verbose(
     cl::desc("Enable verbose output for StorePropagation"),
     cl::init(false));
 
+/* Opt-in registration at the default pipeline extension points. Under clang
+ * the plugin must also be loaded with -Xclang -load so that -mllvm can see
+ * this option before the pipeline is built.
+ */
+cl::opt<bool> StorePropagation::pipelineEP(
+    "store-prop-ep",
+    cl::desc("Add StorePropagation to the default O1-O3 and LTO pipelines"),
+    cl::init(false));
+
+cl::opt<bool> StorePropagation::costModel(
+    "store-prop-cost-model",
+    cl::desc("Only forward stored values when the live range extension is "
+             "cheaper than the load"),
+    cl::init(false));
+
+cl::opt<unsigned> StorePropagation::maxLiveDistance(
+    "store-prop-max-live-distance",
+    cl::desc("Cost model: longest live range extension, in instructions"),
+    cl::init(64));
+
+cl::opt<unsigned> StorePropagation::maxCallsCrossed(
+    "store-prop-max-calls-crossed",
+    cl::desc("Cost model: most calls a forwarded value may be live across"),
+    cl::init(0));
+
+cl::opt<bool> StorePropagation::constFold(
+    "store-prop-fold",
+    cl::desc("Fold constants and prune branches after propagation"),
+    cl::init(true));
+
+cl::opt<unsigned> StorePropagation::maxFoldRounds(
+    "store-prop-fold-rounds",
+    cl::desc("Most times to re-run propagation after pruning branches"),
+    cl::init(4));
+
+cl::opt<PropTier> StorePropagation::tier(
+    "store-prop-tier",
+    cl::desc("Propagation scope"),
+    cl::values(
+        clEnumValN(TierLocal, "local", "Within basic blocks only"),
+        clEnumValN(TierEBB, "ebb", "Along extended basic blocks"),
+        clEnumValN(TierGlobal, "global", "Whole function (default)"),
+        clEnumValN(TierDomTree, "domtree",
+                   "Whole function, scoped dominator tree walk")),
+    cl::init(TierGlobal));
+
+cl::opt<unsigned> StorePropagation::dfaLimit(
+    "store-prop-dfa-limit",
+    cl::desc("Largest blocks x copies to solve globally; larger functions "
+             "fall back to the ebb tier"),
+    cl::init(1u << 24));
+
+cl::opt<bool> StorePropagation::escapeAnalysis(
+    "store-prop-escape",
+    cl::desc("Let copies to non-escaping allocas survive calls"),
+    cl::init(true));
+
+cl::opt<bool> StorePropagation::loopPromotion(
+    "store-prop-loops",
+    cl::desc("Hoist and promote non-escaping locations accessed in loops"),
+    cl::init(true));
+
+cl::opt<std::string> StorePropagation::cacheDir(
+    "store-prop-cache-dir",
+    cl::desc("Directory for the persistent rewrite cache (off if empty)"),
+    cl::init(""));
+
+cl::opt<bool> StorePropagation::cacheStats(
+    "store-prop-cache-stats",
+    cl::desc("Print analysis cache hit/miss counts at exit"),
+    cl::init(false));
+
+/* digest returns the MD5 of text in hex. */
+static std::string digest(StringRef text)
+{
+    MD5 hash;
+    hash.update(text);
+    MD5::MD5Result result;
+    hash.final(result);
+    return std::string(result.digest().str());
+}
+
+/* Cache counters for the whole process. cpass-batch runs functions on
+ * several threads, hence the atomics.
+ */
+static struct CacheCounters {
+    std::atomic<unsigned> hits{0};
+    std::atomic<unsigned> misses{0};
+    std::atomic<unsigned> stale{0};
+    std::atomic<unsigned> uncacheable{0};
+
+    ~CacheCounters() {
+        if (StorePropagation::cacheStats && !StorePropagation::cacheDir.empty())
+            errs() << "store-prop cache: " << hits << " hits, " << misses
+                   << " misses, " << stale << " stale, " << uncacheable
+                   << " uncacheable\n";
+    }
+} cache_counters;
+
 PreservedAnalyses StorePropagation::run(Function &F, FunctionAnalysisManager &AM) {
 	if (verbose)
 		errs() << "Running StorePropagation on function: " << F.getName() << "\n";
 
-	localStorePropagation(F);
-	globalStorePropagation(F);
+	/* With a cache directory, a function seen before replays the recorded
+	 * rewrites instead of solving. If the replay does not match the IR, the
+	 * entry is stale: finish with a normal run from wherever replay stopped
+	 * and record a fresh entry, starting with the steps already replayed so
+	 * that it describes everything done to the original function.
+	 */
+	std::string key;
+	recording = false;
+	ir_changed = cfg_changed = false;
+	if (!cacheDir.empty()) {
+		key = cacheKey(F);
+		numberInstructions(F);
+
+		SmallString<256> path(cacheDir.getValue());
+		sys::path::append(path, key);
+		auto buf = MemoryBuffer::getFile(path);
+		cache_log.clear();
+		if (buf && replayCache(F, (*buf)->getBuffer())) {
+			cache_counters.hits++;
+			return preserved();
+		}
+
+		if (buf)
+			cache_counters.stale++;
+		else
+			cache_counters.misses++;
+		recording = true;
+
+		// A partial replay may have changed the CFG under LoopInfo.
+		if (!cache_log.empty())
+			AM.invalidate(F, PreservedAnalyses::none());
+	}
+
+	// Only foldConstants changes the CFG; LoopInfo is refreshed after it.
+	loops = costModel || loopPromotion ? &AM.getResult<LoopAnalysis>(F)
+	                                   : nullptr;
+	nr_kept = 0;
+
+	propagate(F);
+
+	/* Folding the constants that propagation exposed can resolve branches.
+	 * Pruning a dead edge removes its stores from the CPIn intersection at
+	 * the join, so propagation is run again on the simplified CFG.
+	 */
+	for (unsigned round = 0; constFold && round < maxFoldRounds; ++round) {
+		bool changed = foldConstants(F);
+		if (recording)
+			cache_log += changed ? "F 1\n" : "F 0\n";
+		if (!changed)
+			break;
+
+		if (loops) {
+			AM.invalidate(F, PreservedAnalyses::none());
+			loops = &AM.getResult<LoopAnalysis>(F);
+		}
+
+		propagate(F);
+	}
+
+	if (verbose && costModel)
+		errs() << "cost model kept " << nr_kept << " loads\n";
+
+	if (recording) {
+		// Write to a unique file first so readers never see a partial entry.
+		SmallString<256> tmp, path(cacheDir.getValue());
+		sys::path::append(path, key);
+		int fd;
+		if (!sys::fs::create_directories(cacheDir) &&
+		    !sys::fs::createUniqueFile(path + ".tmp%%%%%%", fd, tmp)) {
+			{
+				raw_fd_ostream os(fd, true);
+				os << "store-prop-cache " << digest(cache_log) << '\n'
+				   << cache_log;
+			}
+			if (sys::fs::rename(tmp, path))
+				sys::fs::remove(tmp);
+		}
+		recording = false;
+	}
+
+	return preserved();
+}
+
+/*
+ * preserved returns every analysis if the run left F alone. Forwarding,
+ * promotion and folding only replace and delete instructions, so the CFG
+ * analyses (dominator trees, LoopInfo) survive unless a branch was pruned.
+ */
+PreservedAnalyses StorePropagation::preserved() const
+{
+    if (!ir_changed)
+        return PreservedAnalyses::all();
+
+    PreservedAnalyses PA;
+    if (!cfg_changed)
+        PA.preserveSet<CFGAnalyses>();
+    return PA;
+}
+
+/*
+ * cacheKey hashes everything the rewrites of F depend on: the text of F, the
+ * attributes of the functions it calls (they decide what clobbers memory),
+ * the global variables it uses (foldConstants folds loads from constant
+ * ones), the data layout used for folding, the pass options, and the plugin
+ * build.
+ */
+std::string StorePropagation::cacheKey(Function &F)
+{
+    std::string text;
+    raw_string_ostream os(text);
+
+    os << "store-prop " << LLVM_VERSION_STRING << ' ' << __DATE__ << ' '
+       << __TIME__ << '\n'
+       << "tier=" << (int)tier << " cost=" << costModel << ','
+       << maxLiveDistance << ',' << maxCallsCrossed << " fold=" << constFold
+       << ',' << maxFoldRounds << " dfa=" << dfaLimit << " escape="
+       << escapeAnalysis << " loops=" << loopPromotion << " direct="
+       << directOnly << '\n'
+       << F.getParent()->getDataLayoutStr() << '\n'
+       << F.getParent()->getTargetTriple() << '\n';
+    F.print(os);
+    for (Instruction &I : instructions(F))
+        if (auto *CB = dyn_cast<CallBase>(&I))
+            if (Function *callee = CB->getCalledFunction())
+                os << callee->getName() << ' '
+                   << callee->getAttributes().getAsString(
+                          AttributeList::FunctionIndex) << '\n';
+
+    /* Print each global variable F refers to, directly or through constant
+     * expressions, with its constness and initializer. Initializers can
+     * name further globals that folding reads through, so they are
+     * followed as well.
+     */
+    SmallPtrSet<const Constant*, 16> seen;
+    SmallVector<const Constant*, 16> work;
+    for (Instruction &I : instructions(F))
+        for (Value *op : I.operands())
+            if (auto *C = dyn_cast<Constant>(op))
+                work.push_back(C);
+    while (!work.empty()) {
+        const Constant *C = work.pop_back_val();
+        if (isa<Function>(C) || !seen.insert(C).second)
+            continue;
+        if (auto *GV = dyn_cast<GlobalVariable>(C)) {
+            GV->print(os);
+            os << '\n';
+            if (GV->hasInitializer())
+                work.push_back(GV->getInitializer());
+            continue;
+        }
+        for (const Use &U : C->operands())
+            if (auto *op = dyn_cast<Constant>(U.get()))
+                work.push_back(op);
+    }
+
+    return digest(os.str());
+}
+
+/*
+ * numberInstructions gives every instruction of F its position as an id,
+ * before anything is rewritten. The only loads and stores the pass creates
+ * are those of loop promotion, which cacheNumber numbers after them in the
+ * order they are created, so these ids name loads and stores for the whole
+ * run.
+ */
+void StorePropagation::numberInstructions(Function &F)
+{
+    cache_insts.clear();
+    cache_ids.clear();
+    for (Instruction &I : instructions(F)) {
+        cache_ids[&I] = cache_insts.size();
+        cache_insts.push_back(WeakVH(&I));
+    }
+}
+
+/*
+ * cacheNumber gives I, created by the pass, the next id. Replay creates the
+ * same instructions in the same order, so they get the same ids as when the
+ * log was recorded.
+ */
+void StorePropagation::cacheNumber(Instruction *I)
+{
+    if (cacheDir.empty())
+        return;
+    cache_ids[I] = cache_insts.size();
+    cache_insts.push_back(WeakVH(I));
+}
+
+/*
+ * replayCache applies a recorded rewrite log to F. The log starts with a
+ * line "store-prop-cache <md5 of the rest>", followed by one line per event
+ * in the order they happened:
+ *
+ *   L <load> S <store>   the load was replaced by the stored value
+ *   L <load> A <arg>     the load was replaced by an argument
+ *   P <inst> <alloca>    the alloca was promoted in the loop whose header
+ *                        holds inst
+ *   F <0|1>              foldConstants ran (1: it changed the CFG)
+ *
+ * The whole log is checked before anything is changed: the checksum, the
+ * syntax, and the kind and type of every instruction that existed before
+ * the run. Each step is then checked against the IR as it is applied, and
+ * appended to cache_log; returns false at the first one that does not
+ * match, leaving in cache_log exactly the steps that were applied.
+ *
+ * Availability is not re-checked (that is the analysis the cache saves), so
+ * a log is only trusted when its key and checksum match.
+ */
+bool StorePropagation::replayCache(Function &F, StringRef log)
+{
+    StringRef header, body;
+    std::tie(header, body) = log.split('\n');
+    if (header != "store-prop-cache " + digest(body))
+        return false;
+
+    SmallVector<StringRef, 64> lines;
+    body.split(lines, '\n', -1, false);
+
+    auto inst = [&](StringRef id) -> Instruction* {
+        unsigned n;
+        if (id.getAsInteger(10, n) || n >= cache_insts.size())
+            return nullptr;
+        return cast_or_null<Instruction>(cache_insts[n]);
+    };
+
+    /* Check every line first. Ids past the original instructions name
+     * loads and stores that loop promotion creates during the replay, so
+     * only their syntax can be checked here.
+     */
+    auto created = [&](StringRef id) {
+        unsigned n;
+        return !id.getAsInteger(10, n) && n >= cache_insts.size();
+    };
+    for (StringRef line : lines) {
+        SmallVector<StringRef, 4> f;
+        line.split(f, ' ');
+        unsigned n;
+
+        if (f.size() == 2 && f[0] == "F") {
+            if (f[1] != "0" && f[1] != "1")
+                return false;
+            continue;
+        }
+        if (f.size() == 3 && f[0] == "P") {
+            if ((!created(f[1]) && !inst(f[1])) ||
+                !isa_and_nonnull<AllocaInst>(inst(f[2])))
+                return false;
+            continue;
+        }
+        if (f.size() != 4 || f[0] != "L")
+            return false;
+
+        auto *load = dyn_cast_or_null<LoadInst>(inst(f[1]));
+        if (!load && !created(f[1]))
+            return false;
+        Type *ty = nullptr;
+        if (f[2] == "S") {
+            auto *SI = dyn_cast_or_null<StoreInst>(inst(f[3]));
+            if (!SI && !created(f[3]))
+                return false;
+            if (SI)
+                ty = SI->getOperand(SRC_IDX)->getType();
+        } else if (f[2] == "A") {
+            if (f[3].getAsInteger(10, n) || n >= F.arg_size())
+                return false;
+            ty = F.getArg(n)->getType();
+        } else {
+            return false;
+        }
+        if (load && ty && ty != load->getType())
+            return false;
+    }
+
+    // Loops and escapes as propagate saw them; recomputed after each fold.
+    std::unique_ptr<LoopInfo> li;
+
+    for (StringRef line : lines) {
+        SmallVector<StringRef, 4> f;
+        line.split(f, ' ');
+
+        if (f[0] == "F") {
+            bool changed = foldConstants(F);
+            cache_log += changed ? "F 1\n" : "F 0\n";
+            if (changed != (f[1] == "1"))
+                return false;
+            li.reset();
+            continue;
+        }
+        if (f[0] == "P") {
+            Instruction *hdr = inst(f[1]);
+            auto *AI = dyn_cast_or_null<AllocaInst>(inst(f[2]));
+            if (!hdr || !AI)
+                return false;
+            if (!li) {
+                escapes.analyze(F, escapeAnalysis);
+                DominatorTree DT(F);
+                li = std::make_unique<LoopInfo>(DT);
+            }
+            Loop *L = li->getLoopFor(hdr->getParent());
+            if (!L || L->getHeader() != hdr->getParent() ||
+                !promoteLocation(L, AI))
+                return false;
+            (cache_log += line) += '\n';
+            continue;
+        }
 
-	return PreservedAnalyses::none();
+        auto *load = dyn_cast_or_null<LoadInst>(inst(f[1]));
+        if (!load)
+            return false;
+
+        Value *known = nullptr;
+        if (f[2] == "S") {
+            auto *SI = dyn_cast_or_null<StoreInst>(inst(f[3]));
+            if (!SI || SI->getOperand(DST_IDX) != load->getPointerOperand())
+                return false;
+            known = SI->getOperand(SRC_IDX);
+        } else {
+            unsigned n;
+            f[3].getAsInteger(10, n);
+            known = F.getArg(n);
+            if (known != load->getPointerOperand())
+                return false;
+        }
+
+        if (known->getType() != load->getType())
+            return false;
+        load->replaceAllUsesWith(known);
+        load->eraseFromParent();
+        ir_changed = true;
+        (cache_log += line) += '\n';
+    }
+
+    if (verbose)
+    {
+        errs() << "post cache replay\n" << F << "\n";
+    }
+    return true;
 }
 
 
@@ -92,6 +719,168 @@ struct RemoveOptNone : public PassInfoMixin<RemoveOptNone> {
     }
 };
 
+/* LoadCounters instruments every load and store in the module with a
+ * counter of how often it runs, so that an unoptimized and an optimized
+ * build of the same program can be compared dynamically. Run it after
+ * store-prop, so that the counters see only the loads and stores left.
+ *
+ * At exit, the counters are appended to the -store-prop-profile file, one
+ * line per site:
+ *
+ *   <load|store> <function> <file> <line> <count>
+ *
+ * File and line come from the debug location (compile with -g); sites
+ * without one are reported as "? 0". scripts/load_report.sh compares two
+ * profiles. Everything is emitted as IR, so no runtime library is needed
+ * beyond the C library's fopen, fprintf and atexit.
+ */
+struct LoadCounters : public PassInfoMixin<LoadCounters> {
+    static cl::opt<std::string> profileFile;
+
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+        if (M.getNamedGlobal("__store_prop_counts"))
+            return PreservedAnalyses::all();
+
+        LLVMContext &C = M.getContext();
+        IRBuilder<> B(C);
+        Type *i8p = B.getInt8PtrTy();
+        Type *i32 = B.getInt32Ty();
+        Type *i64 = B.getInt64Ty();
+        StructType *siteTy = StructType::get(C, {i8p, i8p, i8p, i32});
+
+        StringMap<Constant*> strings;
+        auto str = [&](StringRef s) {
+            Constant *&c = strings[s];
+            if (!c)
+                c = B.CreateGlobalStringPtr(s, "__store_prop_str", 0, &M);
+            return c;
+        };
+
+        std::vector<Instruction*> sites;
+        std::vector<Constant*> info;
+        for (Function &F : M) {
+            for (Instruction &I : instructions(F)) {
+                if (!isa<LoadInst>(&I) && !isa<StoreInst>(&I))
+                    continue;
+                const DebugLoc &loc = I.getDebugLoc();
+                sites.push_back(&I);
+                info.push_back(ConstantStruct::get(siteTy, {
+                    str(isa<LoadInst>(&I) ? "load" : "store"),
+                    str(F.getName()),
+                    str(loc ? loc->getFilename() : "?"),
+                    B.getInt32(loc ? loc.getLine() : 0)}));
+            }
+        }
+        if (sites.empty())
+            return PreservedAnalyses::all();
+
+        uint64_t n = sites.size();
+        ArrayType *countsTy = ArrayType::get(i64, n);
+        ArrayType *sitesTy = ArrayType::get(siteTy, n);
+        auto *counts = new GlobalVariable(
+            M, countsTy, false, GlobalValue::InternalLinkage,
+            ConstantAggregateZero::get(countsTy), "__store_prop_counts");
+        auto *table = new GlobalVariable(
+            M, sitesTy, true, GlobalValue::InternalLinkage,
+            ConstantArray::get(sitesTy, info), "__store_prop_sites");
+
+        for (uint64_t k = 0; k < n; ++k) {
+            B.SetInsertPoint(sites[k]);
+            Value *slot = B.CreateConstInBoundsGEP2_64(countsTy, counts, 0, k);
+            B.CreateAtomicRMW(AtomicRMWInst::Add, slot, B.getInt64(1),
+                              MaybeAlign(8), AtomicOrdering::Monotonic);
+        }
+
+        // __store_prop_dump appends one line per site to the profile file.
+        FunctionCallee fopenFn = M.getOrInsertFunction("fopen", i8p, i8p, i8p);
+        FunctionCallee fcloseFn = M.getOrInsertFunction("fclose", i32, i8p);
+        FunctionCallee fprintfFn = M.getOrInsertFunction(
+            "fprintf", FunctionType::get(i32, {i8p, i8p}, true));
+        Function *dump = Function::Create(
+            FunctionType::get(B.getVoidTy(), false),
+            GlobalValue::InternalLinkage, "__store_prop_dump", M);
+
+        BasicBlock *entry = BasicBlock::Create(C, "entry", dump);
+        BasicBlock *loop = BasicBlock::Create(C, "loop", dump);
+        BasicBlock *close = BasicBlock::Create(C, "close", dump);
+        BasicBlock *done = BasicBlock::Create(C, "done", dump);
+
+        B.SetInsertPoint(entry);
+        Value *file = B.CreateCall(fopenFn, {str(profileFile), str("a")});
+        B.CreateCondBr(B.CreateIsNull(file), done, loop);
+
+        B.SetInsertPoint(loop);
+        PHINode *i = B.CreatePHI(i64, 2);
+        i->addIncoming(B.getInt64(0), entry);
+        Value *site = B.CreateInBoundsGEP(sitesTy, table, {B.getInt64(0), i});
+        Value *args[7] = {file, str("%s %s %s %u %llu\n")};
+        for (unsigned f = 0; f < 4; ++f)
+            args[2 + f] = B.CreateLoad(siteTy->getElementType(f),
+                                       B.CreateStructGEP(siteTy, site, f));
+        args[6] = B.CreateLoad(
+            i64, B.CreateInBoundsGEP(countsTy, counts, {B.getInt64(0), i}));
+        B.CreateCall(fprintfFn, args);
+        Value *next = B.CreateAdd(i, B.getInt64(1));
+        i->addIncoming(next, loop);
+        B.CreateCondBr(B.CreateICmpEQ(next, B.getInt64(n)), close, loop);
+
+        B.SetInsertPoint(close);
+        B.CreateCall(fcloseFn, {file});
+        B.CreateBr(done);
+
+        B.SetInsertPoint(done);
+        B.CreateRetVoid();
+
+        // Register the dump from a constructor, so it runs after main.
+        FunctionCallee atexitFn = M.getOrInsertFunction(
+            "atexit", i32, dump->getType());
+        Function *init = Function::Create(
+            FunctionType::get(B.getVoidTy(), false),
+            GlobalValue::InternalLinkage, "__store_prop_init", M);
+        B.SetInsertPoint(BasicBlock::Create(C, "entry", init));
+        B.CreateCall(atexitFn, {dump});
+        B.CreateRetVoid();
+        appendToGlobalCtors(M, init, 0);
+
+        return PreservedAnalyses::none();
+    }
+};
+
+cl::opt<std::string> LoadCounters::profileFile(
+    "store-prop-profile",
+    cl::desc("File that store-prop-instrument builds append counts to"),
+    cl::init("store_prop.prof"));
+
+#if LLVM_VERSION_MAJOR < 15
+/* LLVM 14 has no extension point in the full LTO pipeline other than
+ * Peephole, which that pipeline invokes three times. FullLTOState tells
+ * those invocations apart from the ones inside a simplification pipeline
+ * (which already runs the pass at ScalarOptimizerLate): every per-TU and
+ * ThinLTO pipeline invokes PipelineEarlySimplification before its first
+ * Peephole and OptimizerLast after its last one, and full LTO invokes
+ * neither. It also records the functions already done, so that the pass
+ * runs once per function rather than once per Peephole point.
+ */
+struct FullLTOState {
+    bool simplifying = false;
+    ValueMap<const Function*, bool> done;
+};
+
+struct FullLTOPeephole : public PassInfoMixin<FullLTOPeephole> {
+    std::shared_ptr<FullLTOState> state;
+    StorePropagation pass{true};
+
+    explicit FullLTOPeephole(std::shared_ptr<FullLTOState> s)
+        : state(std::move(s)) {}
+
+    PreservedAnalyses run(Function &F, FunctionAnalysisManager &AM) {
+        if (!state->done.insert({&F, true}).second)
+            return PreservedAnalyses::all();
+        return pass.run(F, AM);
+    }
+};
+#endif
+
 extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
     return {
         LLVM_PLUGIN_API_VERSION, "StorePropagation", LLVM_VERSION_STRING,
@@ -103,6 +892,10 @@ extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
                         MPM.addPass(RemoveOptNone());
                         return true;
                     }
+                    if (Name == "store-prop-instrument") {
+                        MPM.addPass(LoadCounters());
+                        return true;
+                    }
                     return false;
                 });
 
@@ -115,6 +908,50 @@ extern "C" ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
                     }
                     return false;
                 });
+
+            /* The extension point callbacks check pipelineEP when the
+             * pipeline is built rather than here, since clang loads
+             * -fpass-plugin objects after the command line is parsed.
+             * ScalarOptimizerLate is part of the function simplification
+             * pipeline, so the pass runs once per function per pipeline
+             * (ThinLTO runs it in both the pre-link and post-link
+             * pipelines). Full LTO does not build that pipeline and gets
+             * its own extension point below: FullLinkTimeOptimizationLast
+             * on LLVM 15 and later, the Peephole points on LLVM 14 (see
+             * FullLTOState).
+             */
+            PB.registerScalarOptimizerLateEPCallback(
+                [](FunctionPassManager &FPM, OptimizationLevel Level) {
+                    if (StorePropagation::pipelineEP &&
+                        Level != OptimizationLevel::O0)
+                        FPM.addPass(StorePropagation(true));
+                });
+
+#if LLVM_VERSION_MAJOR >= 15
+            PB.registerFullLinkTimeOptimizationLastEPCallback(
+                [](ModulePassManager &MPM, OptimizationLevel Level) {
+                    if (StorePropagation::pipelineEP &&
+                        Level != OptimizationLevel::O0)
+                        MPM.addPass(createModuleToFunctionPassAdaptor(
+                            StorePropagation(true)));
+                });
+#else
+            auto lto = std::make_shared<FullLTOState>();
+            PB.registerPipelineEarlySimplificationEPCallback(
+                [lto](ModulePassManager &, OptimizationLevel) {
+                    lto->simplifying = true;
+                });
+            PB.registerOptimizerLastEPCallback(
+                [lto](ModulePassManager &, OptimizationLevel) {
+                    lto->simplifying = false;
+                });
+            PB.registerPeepholeEPCallback(
+                [lto](FunctionPassManager &FPM, OptimizationLevel Level) {
+                    if (StorePropagation::pipelineEP &&
+                        Level != OptimizationLevel::O0 && !lto->simplifying)
+                        FPM.addPass(FullLTOPeephole(lto));
+                });
+#endif
         }};
 }
 }
@@ -132,15 +969,33 @@ class DataFlowAnalysis
         std::map<BasicBlock*, BasicBlockInfo*> bb_info;
         unsigned int nr_copies;
 
+        /* Destination location of each copy, and the set of all of them.
+         * An argument is its own location.
+         */
+        std::vector<Value*> copy_dst;
+        std::set<Value*> dsts;
+
+        /* Copies whose location a call may write; see EscapeInfo. */
+        const EscapeInfo &escapes;
+        BitVector clobberable;
+
+        /* ACP layers already built, by the CPIn they represent. */
+        DenseMap<BitVector, std::shared_ptr<const ACPLayer>> acp_layers;
+        BasicBlockInfo *last_acp = nullptr;
+        unsigned nr_acp_entries = 0;
+
         void addCopy(Value *v);
         void initCopyIdxs(Function &F);
         void initCOPYAndKILLSets(Function &F);
         void initCPInAndCPOutSets(Function &F);
-        void initACPs();
+        bool needsACP(BasicBlock &bb);
+        std::shared_ptr<const ACPLayer> buildACPLayer(BasicBlock &bb);
 
     public:
-        DataFlowAnalysis(Function &F);
+        DataFlowAnalysis(Function &F, const EscapeInfo &ei);
+        ~DataFlowAnalysis();
         ACPTable &getACP(BasicBlock &bb);
+        void printACPStats();
         void printCopyIdxs();
         void printDFA();
 };
@@ -151,6 +1006,84 @@ class DataFlowAnalysis
  */
 
 
+/*
+ * analyze finds the allocas of F whose address escapes: it follows each
+ * alloca through the pointers derived from it, and any use other than as
+ * the address of a load or store (or of a debug or lifetime marker) lets
+ * the address out. Private allocas with no derived pointers are also
+ * direct. With enabled false every location is Unknown.
+ */
+void EscapeInfo::analyze(Function &F, bool on)
+{
+    enabled = on;
+    escaped.clear();
+    direct.clear();
+    if (!enabled)
+        return;
+
+    for (Instruction &ins : instructions(F)) {
+        auto *AI = dyn_cast<AllocaInst>(&ins);
+        if (!AI)
+            continue;
+
+        bool esc = false, derived = false;
+        SmallPtrSet<Value*, 8> visited;
+        std::vector<Value*> worklist(1, AI);
+        while (!worklist.empty() && !esc) {
+            Value *ptr = worklist.back();
+            worklist.pop_back();
+            if (!visited.insert(ptr).second)
+                continue;
+
+            for (User *U : ptr->users()) {
+                if (isa<LoadInst>(U) || isa<ICmpInst>(U))
+                    continue;
+                if (auto *SI = dyn_cast<StoreInst>(U)) {
+                    if (SI->getOperand(SRC_IDX) == ptr)
+                        esc = true;
+                    continue;
+                }
+                if (isa<GetElementPtrInst>(U) || isa<BitCastInst>(U) ||
+                    isa<AddrSpaceCastInst>(U) || isa<SelectInst>(U) ||
+                    isa<PHINode>(U)) {
+                    derived = true;
+                    worklist.push_back(U);
+                    continue;
+                }
+                if (auto *II = dyn_cast<IntrinsicInst>(U))
+                    if (isa<DbgInfoIntrinsic>(II) || II->isLifetimeStartOrEnd())
+                        continue;
+                esc = true;
+                break;
+            }
+        }
+        escaped[AI] = esc;
+        if (!esc && !derived)
+            direct.insert(AI);
+    }
+}
+
+bool EscapeInfo::isDirect(Value *loc) const
+{
+    auto *AI = dyn_cast<AllocaInst>(loc);
+    return enabled && AI && direct.count(AI);
+}
+
+EscapeInfo::Kind EscapeInfo::classify(Value *loc) const
+{
+    if (!enabled)
+        return Unknown;
+
+    auto *AI = dyn_cast<AllocaInst>(getUnderlyingObject(loc));
+    if (!AI)
+        return Unknown;
+
+    auto it = escaped.find(AI);
+    if (it == escaped.end())
+        return Unknown;
+    return it->second ? Escaped : Private;
+}
+
 /*
  * propagateStores performs store propagation over the block bb using the
  * associated values in the ACP table. It also removes load instructions if
@@ -186,12 +1119,15 @@ void StorePropagation::propagateStores(BasicBlock &bb, ACPTable &acp)
         // Copy-propagate operands using the current ACP.
         for (unsigned opIdx = 0; opIdx < I->getNumOperands(); ++opIdx) {
             Value *Op = I->getOperand(opIdx);
-            auto acpIt = acp.find(Op);
-            if (acpIt != acp.end()) {
-                Value *Src = acpIt->second;
-                // Only substitute if the types match and we actually change something.
-                if (Src != Op && Src->getType() == Op->getType()) {
-                    I->setOperand(opIdx, Src);
+            Value *Src = mayForward(Op) ? acp.lookup(Op) : nullptr;
+            // Only substitute if the types match and we actually change something.
+            if (Src && Src != Op && Src->getType() == Op->getType()) {
+                I->setOperand(opIdx, Src);
+                ir_changed = true;
+                // The rewrite log only describes forwarded loads.
+                if (recording) {
+                    recording = false;
+                    cache_counters.uncacheable++;
                 }
             }
         }
@@ -200,36 +1136,159 @@ void StorePropagation::propagateStores(BasicBlock &bb, ACPTable &acp)
 
         // STORE: update mapping for the destination location.
         if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
-            Value *Src = SI->getOperand(SRC_IDX); // value being stored
             Value *Dst = SI->getOperand(DST_IDX); // location (pointer)
 
-            // Memory at Dst is overwritten: previous info about *Dst is invalid.
-            acp.erase(Dst);
-
-            // New copy <Dst, Src>
-            acp[Dst] = Src;
+            // New copy <Dst, Src>; replaces whatever was known about *Dst.
+            acp.insert(Dst, SI);
             continue;
         }
 
         // LOAD: if we know the value at *Ptr, replace the load with that value.
         if (LoadInst *LI = dyn_cast<LoadInst>(I)) {
             Value *Ptr = LI->getPointerOperand();
-            auto itLoc = acp.find(Ptr);
-            if (itLoc != acp.end()) {
-                Value *Known = itLoc->second;
-                if (Known->getType() == LI->getType()) {
+            Value *Copy = mayForward(Ptr) ? acp.findCopy(Ptr) : nullptr;
+            if (Value *Known = resolveCopy(Ptr, Copy)) {
+                if (Known->getType() == LI->getType() &&
+                    worthForwarding(Known, LI)) {
                     // Replace uses of the load with the known value and delete the load.
-                    LI->replaceAllUsesWith(Known);
-                    LI->eraseFromParent();
+                    forwardLoad(LI, Copy, Known);
                 }
             }
             continue;
         }
 
-        
+        // CALL: forget whatever it may have overwritten.
+        if (isClobber(I))
+            acp.killClobbered(escapes);
     }
 }
 
+/*
+ * forwardLoad replaces load with known, the value that copy (a store or an
+ * argument) made available, and records the rewrite for the cache.
+ */
+void StorePropagation::forwardLoad(LoadInst *load, Value *copy, Value *known)
+{
+    if (recording) {
+        raw_string_ostream os(cache_log);
+        os << "L " << cache_ids.lookup(load) << ' ';
+        if (auto *A = dyn_cast<Argument>(copy))
+            os << "A " << A->getArgNo();
+        else
+            os << "S " << cache_ids.lookup(copy);
+        os << '\n';
+    }
+
+    load->replaceAllUsesWith(known);
+    load->eraseFromParent();
+    ir_changed = true;
+}
+
+/*
+ * worthForwarding implements the optional register pressure cost model.
+ * Replacing load with v keeps v live from its definition down to the load.
+ * On targets with few registers that only pays off while the extension is
+ * short and does not cross a call: a value live across a call is spilled and
+ * reloaded around it, which costs more than the load it replaces.
+ *
+ * The estimate counts the instructions and calls between the definition and
+ * the load within their blocks, and adds the whole body of every loop that
+ * contains the load but not the definition, since v then stays live across
+ * every iteration. Blocks in between are not walked.
+ */
+bool StorePropagation::worthForwarding(Value *v, LoadInst *load)
+{
+    if (!costModel || isa<Constant>(v))
+        return true;
+
+    BasicBlock *useBB = load->getParent();
+    Instruction *def = dyn_cast<Instruction>(v);
+
+    // Already live past the load: forwarding does not extend anything.
+    for (User *U : v->users()) {
+        Instruction *UI = dyn_cast<Instruction>(U);
+        if (UI && UI != load && UI->getParent() == useBB &&
+            load->comesBefore(UI))
+            return true;
+    }
+
+    unsigned distance = 0;
+    unsigned calls = 0;
+    auto visit = [&](Instruction *I) {
+        distance++;
+        if (isa<CallBase>(I) && !isa<IntrinsicInst>(I))
+            calls++;
+    };
+
+    for (Instruction *I = load->getPrevNode(); I && I != def;
+         I = I->getPrevNode())
+        visit(I);
+
+    if (!def || def->getParent() != useBB) {
+        if (def)
+            for (Instruction *I = def->getNextNode(); I; I = I->getNextNode())
+                visit(I);
+
+        if (loops) {
+            for (Loop *L = loops->getLoopFor(useBB); L; L = L->getParentLoop()) {
+                if (def && L->contains(def))
+                    break;
+                for (BasicBlock *bb : L->blocks())
+                    if (bb != useBB)
+                        for (Instruction &I : *bb)
+                            visit(&I);
+            }
+        }
+    }
+
+    if (calls <= maxCallsCrossed && distance <= maxLiveDistance)
+        return true;
+
+    nr_kept++;
+    return false;
+}
+
+/*
+ * propagate runs the propagation phases selected by -store-prop-tier. The
+ * global tier needs bit vectors of nr_copies bits per block; when that
+ * exceeds -store-prop-dfa-limit, it falls back to the ebb tier, which gets
+ * most of the benefit in linear time. Loop promotion runs first in every
+ * tier, so that the loads it leaves in preheaders are forwarded by the
+ * phases after it.
+ */
+void StorePropagation::propagate(Function &F)
+{
+    escapes.analyze(F, escapeAnalysis);
+
+    if (loops && loopPromotion)
+        loopStorePropagation(F);
+
+    if (tier == TierDomTree) {
+        domStorePropagation(F);
+        return;
+    }
+
+    bool global = tier == TierGlobal;
+    if (global) {
+        uint64_t nr_blocks = 0, nr_copies = F.arg_size();
+        for (BasicBlock &bb : F) {
+            nr_blocks++;
+            for (Instruction &ins : bb)
+                if (isa<StoreInst>(&ins))
+                    nr_copies++;
+        }
+        global = nr_blocks * nr_copies <= dfaLimit;
+    }
+
+    if (tier == TierLocal || global)
+        localStorePropagation(F);
+    else
+        ebbStorePropagation(F);
+
+    if (global)
+        globalStorePropagation(F);
+}
+
 /*
  * localStorePropagation performs local store propagation (LSP) over the basic
  * blocks in the function F. The algorithm for LSP described on pp. 357-358 in
@@ -260,6 +1319,412 @@ void StorePropagation::localStorePropagation(Function &F)
 }
 
 
+/*
+ * ebbStorePropagation carries the ACP down extended basic blocks: a block
+ * whose only predecessor is bb starts with the ACP that bb ends with, since
+ * every path into it comes through bb. Each EBB is walked depth first from
+ * its root (the entry or a block with several predecessors) with one table;
+ * the updates made in a subtree are undone before moving on to its sibling.
+ * Roots start empty, as in local propagation.
+ */
+void StorePropagation::ebbStorePropagation(Function &F)
+{
+    struct Frame {
+        BasicBlock *bb;
+        size_t      mark;  // ACP state at the end of the parent
+    };
+
+    ACPTable acp;
+    std::vector<Frame> stack;
+    BasicBlock *entry = &F.getEntryBlock();
+
+    for (BasicBlock &root : F) {
+        if (&root != entry && root.getSinglePredecessor())
+            continue;
+
+        stack.push_back({&root, 0});
+        while (!stack.empty()) {
+            Frame fr = stack.back();
+            stack.pop_back();
+
+            acp.undo(fr.mark);
+            propagateStores(*fr.bb, acp);
+
+            size_t mark = acp.mark();
+            for (BasicBlock *succ : successors(fr.bb)) {
+                if (succ != entry && succ->getSinglePredecessor() == fr.bb)
+                    stack.push_back({succ, mark});
+            }
+        }
+        acp.undo(0);
+    }
+
+    if (verbose)
+    {
+        errs() << "post ebb\n" << F << "\n";
+    }
+}
+
+
+/*
+ * domStorePropagation is a third propagation engine, in the style of
+ * EarlyCSE: a single depth-first walk of the dominator tree keeping the
+ * available copies in a ScopedHashTable. Facts made in a block are pushed in
+ * its scope and popped when the walk leaves its dominator subtree. Each fact
+ * records the memory generation it was made in; any instruction other than a
+ * store that may write memory starts a new generation, which invalidates
+ * every older fact about a location it can reach (see EscapeInfo) at once.
+ * There are no per-block bit vectors and no fixpoint iteration.
+ *
+ * A block with one predecessor sees exactly the facts at the end of its
+ * idom. At a join, a fact from the idom survives unless some block between
+ * the idom and the join (walking back from the join's predecessors) stores
+ * to the same location; such locations get a tombstone in the join's scope.
+ * If a block in between may clobber memory, the join starts a new
+ * generation. If the region is larger than MAX_REGION blocks, the join
+ * starts a new epoch, which invalidates every fact. Loop headers are joins
+ * like any other (the header's own body is part of the region through the
+ * back edge), so facts survive into loops that never write them, as with
+ * Muchnick's CPIn at the header.
+ */
+void StorePropagation::domStorePropagation(Function &F)
+{
+    const unsigned MAX_REGION = 32;
+
+    struct Fact {
+        Value   *copy = nullptr;  // null: killed
+        unsigned gen = 0;
+        unsigned epoch = 0;
+    };
+    typedef ScopedHashTable<Value*, Fact> FactTable;
+    typedef ScopedHashTableScope<Value*, Fact> FactScope;
+
+    // Memory state: facts older than gen are only valid for private
+    // locations; facts older than epoch are not valid at all.
+    struct State {
+        unsigned gen = 0;
+        unsigned epoch = 0;
+    };
+
+    struct BlockSummary {
+        bool clobbers = false;
+        std::vector<Value*> stores;
+    };
+
+    struct Frame {
+        FactScope scope;
+        DomTreeNode *node;
+        DomTreeNode::const_iterator next;
+        State state;  // at the end of the block
+
+        Frame(FactTable &table, DomTreeNode *n)
+            : scope(table), node(n), next(n->begin()) {}
+    };
+
+    DominatorTree DT(F);
+    FactTable table;
+    unsigned last_gen = 0;
+    unsigned nr_forwarded = 0;
+
+    // What each block does to memory, for the joins.
+    DenseMap<BasicBlock*, BlockSummary> summary;
+    for (BasicBlock &bb : F) {
+        BlockSummary &bs = summary[&bb];
+        for (Instruction &ins : bb) {
+            if (auto *SI = dyn_cast<StoreInst>(&ins))
+                bs.stores.push_back(SI->getOperand(DST_IDX));
+            else if (isClobber(&ins))
+                bs.clobbers = true;
+        }
+    }
+
+    // Tombstones every location stored between idom and bb and works out
+    // the state bb starts in.
+    auto enterJoin = [&](BasicBlock *bb, BasicBlock *idom, State state) {
+        SmallPtrSet<BasicBlock*, 16> visited;
+        std::vector<BasicBlock*> worklist(pred_begin(bb), pred_end(bb));
+        bool clobbered = false;
+        while (!worklist.empty()) {
+            BasicBlock *p = worklist.back();
+            worklist.pop_back();
+            if (p == idom || !DT.isReachableFromEntry(p) ||
+                !visited.insert(p).second)
+                continue;
+            if (visited.size() > MAX_REGION) {
+                state.gen = state.epoch = ++last_gen;
+                return state;
+            }
+            BlockSummary &bs = summary[p];
+            clobbered |= bs.clobbers;
+            for (Value *loc : bs.stores)
+                table.insert(loc, Fact{nullptr, state.gen, state.epoch});
+            // Reaching bb again means a back edge: its own stores count,
+            // but the region ends there.
+            if (p != bb)
+                worklist.insert(worklist.end(), pred_begin(p), pred_end(p));
+        }
+        if (clobbered)
+            state.gen = ++last_gen;
+        return state;
+    };
+
+    auto process = [&](BasicBlock *bb, State state) {
+        for (auto it = bb->begin(); it != bb->end(); ) {
+            Instruction *I = &*it++;
+
+            if (auto *SI = dyn_cast<StoreInst>(I)) {
+                table.insert(SI->getOperand(DST_IDX),
+                             Fact{SI, state.gen, state.epoch});
+                continue;
+            }
+
+            if (auto *LI = dyn_cast<LoadInst>(I)) {
+                Value *ptr = LI->getPointerOperand();
+                Fact fact = table.lookup(ptr);
+                if (!fact.copy || !mayForward(ptr) ||
+                    fact.epoch != state.epoch ||
+                    (fact.gen != state.gen && escapes.mayClobber(ptr)))
+                    continue;
+                Value *known = fact.copy;
+                if (auto *SI = dyn_cast<StoreInst>(known)) {
+                    if (SI->getOperand(DST_IDX) != ptr)
+                        continue;
+                    known = SI->getOperand(SRC_IDX);
+                }
+                if (known->getType() == LI->getType() &&
+                    worthForwarding(known, LI)) {
+                    forwardLoad(LI, fact.copy, known);
+                    nr_forwarded++;
+                }
+                continue;
+            }
+
+            if (isClobber(I))
+                state.gen = ++last_gen;
+        }
+        return state;
+    };
+
+    // Arguments are degenerate copies a <- a, available from the entry.
+    std::vector<std::unique_ptr<Frame>> stack;
+    stack.push_back(std::make_unique<Frame>(table, DT.getRootNode()));
+    for (Argument &A : F.args())
+        table.insert(&A, Fact{&A, 0, 0});
+    stack.back()->state = process(&F.getEntryBlock(), State());
+
+    while (!stack.empty()) {
+        Frame &top = *stack.back();
+        if (top.next == top.node->end()) {
+            stack.pop_back();
+            continue;
+        }
+
+        DomTreeNode *child = *top.next++;
+        BasicBlock *bb = child->getBlock();
+        State state = top.state;
+
+        stack.push_back(std::make_unique<Frame>(table, child));
+        if (!bb->getSinglePredecessor())
+            state = enterJoin(bb, top.node->getBlock(), state);
+        stack.back()->state = process(bb, state);
+    }
+
+    if (verbose)
+    {
+        errs() << "post domtree (" << nr_forwarded << " forwarded)\n"
+               << F << "\n";
+    }
+}
+
+
+/*
+ * loopStorePropagation handles the loops of F, innermost first. The other
+ * phases cannot forward across a back edge: CPIn at a header is an
+ * intersection over the latch, so a location written in the loop is never
+ * available in it, and one that is not written is only available when its
+ * value happens to be known on entry. Every private alloca accessed in a
+ * loop is handed to promoteLocation, which hoists its loads or keeps it in a
+ * register for the whole loop. Inner loops leave their preheader loads and
+ * exit stores in the outer loop, which then promotes them in turn.
+ *
+ * With the cost model, a loop that has more calls or instructions than a
+ * forwarded value may be live across is left alone, since a promoted value
+ * is live through the whole loop.
+ */
+void StorePropagation::loopStorePropagation(Function &F)
+{
+    unsigned nr_promoted = 0;
+
+    SmallVector<Loop*, 4> order = loops->getLoopsInPreorder();
+    for (Loop *L : reverse(order)) {
+        if (!L->getLoopPreheader())
+            continue;
+
+        if (costModel) {
+            unsigned size = 0, calls = 0;
+            for (BasicBlock *bb : L->blocks())
+                for (Instruction &I : *bb) {
+                    size++;
+                    if (isa<CallBase>(&I) && !isa<IntrinsicInst>(&I))
+                        calls++;
+                }
+            if (calls > maxCallsCrossed || size > maxLiveDistance)
+                continue;
+        }
+
+        // Candidates in the order they are accessed, for a stable log.
+        SmallVector<AllocaInst*, 8> candidates;
+        SmallPtrSet<AllocaInst*, 8> seen;
+        for (BasicBlock *bb : L->blocks())
+            for (Instruction &I : *bb)
+                if (Value *ptr = getLoadStorePointerOperand(&I))
+                    if (auto *AI = dyn_cast<AllocaInst>(ptr))
+                        if (seen.insert(AI).second)
+                            candidates.push_back(AI);
+
+        for (AllocaInst *AI : candidates) {
+            if (!promoteLocation(L, AI))
+                continue;
+            nr_promoted++;
+
+            if (recording) {
+                auto hdr = cache_ids.find(L->getHeader()->getFirstNonPHI());
+                if (hdr == cache_ids.end()) {
+                    recording = false;
+                    cache_counters.uncacheable++;
+                    continue;
+                }
+                raw_string_ostream os(cache_log);
+                os << "P " << hdr->second << ' ' << cache_ids.lookup(AI)
+                   << '\n';
+            }
+        }
+    }
+
+    if (verbose)
+    {
+        errs() << "post loop (" << nr_promoted << " promoted)\n" << F << "\n";
+    }
+}
+
+/*
+ * promoteLocation keeps the alloca AI in a register for the duration of the
+ * loop L, in the style of LICM's scalar promotion. AI must be private and
+ * only used as the address of loads and stores, so nothing in the loop can
+ * read or write it behind those:
+ *
+ * - its value on entry is loaded once in the preheader;
+ * - each load in the loop is replaced by the value reaching it, through the
+ *   phis that SSAUpdater places at the joins of the loop;
+ * - the stores in the loop are deleted, and the final value is stored once
+ *   at the top of each exit block, which must only be reached from the loop.
+ *
+ * If the loop never stores to AI this just hoists its loads. Returns false,
+ * without changing anything, if AI or L do not qualify.
+ */
+bool StorePropagation::promoteLocation(Loop *L, AllocaInst *AI)
+{
+    struct Promoter : public LoadAndStorePromoter {
+        AllocaInst *AI;
+        ArrayRef<BasicBlock*> exits;
+        SmallPtrSet<Instruction*, 16> &insts;
+        SmallVector<StoreInst*, 4> sunk;
+
+        Promoter(ArrayRef<const Instruction*> list, SSAUpdater &S,
+                 AllocaInst *AI, ArrayRef<BasicBlock*> exits,
+                 SmallPtrSet<Instruction*, 16> &insts)
+            : LoadAndStorePromoter(list, S, AI->getName()), AI(AI), exits(exits),
+              insts(insts) {}
+
+        bool isInstInList(Instruction *I,
+                          const SmallVectorImpl<Instruction*> &) const override
+        {
+            return insts.count(I);
+        }
+
+        void doExtraRewritesBeforeFinalDeletion() override
+        {
+            for (BasicBlock *exit : exits) {
+                Value *v = SSA.GetValueInMiddleOfBlock(exit);
+                sunk.push_back(
+                    new StoreInst(v, AI, &*exit->getFirstInsertionPt()));
+            }
+        }
+    };
+
+    BasicBlock *pre = L->getLoopPreheader();
+    Type *ty = AI->getAllocatedType();
+    if (!pre || L->contains(AI) || escapes.classify(AI) != EscapeInfo::Private)
+        return false;
+
+    SmallVector<Instruction*, 16> accesses;
+    bool stores = false;
+    DebugLoc loadLoc, storeLoc;
+    for (User *U : AI->users()) {
+        auto *I = cast<Instruction>(U);
+        if (!isa<LoadInst>(I) && !isa<StoreInst>(I)) {
+            // Markers are fine outside the loop; a derived pointer is not.
+            auto *II = dyn_cast<IntrinsicInst>(I);
+            if (!II || L->contains(II) ||
+                !(isa<DbgInfoIntrinsic>(II) || II->isLifetimeStartOrEnd()))
+                return false;
+            continue;
+        }
+        if (getLoadStorePointerOperand(I) != AI)
+            return false;
+        if (!L->contains(I))
+            continue;
+
+        bool simple = isa<LoadInst>(I) ? cast<LoadInst>(I)->isSimple()
+                                       : cast<StoreInst>(I)->isSimple();
+        if (!simple || getLoadStoreType(I) != ty)
+            return false;
+        stores |= isa<StoreInst>(I);
+        accesses.push_back(I);
+
+        // New accesses are attributed to a line the ones they replace had.
+        DebugLoc &loc = isa<LoadInst>(I) ? loadLoc : storeLoc;
+        if (!loc)
+            loc = I->getDebugLoc();
+    }
+    if (accesses.empty())
+        return false;
+
+    SmallVector<BasicBlock*, 4> exits;
+    if (stores) {
+        if (!L->hasDedicatedExits())
+            return false;
+        L->getUniqueExitBlocks(exits);
+        for (BasicBlock *exit : exits)
+            if (exit->getFirstInsertionPt() == exit->end())
+                return false;
+    }
+
+    auto *init = new LoadInst(ty, AI, AI->getName() + ".promoted",
+                              pre->getTerminator());
+    init->setDebugLoc(loadLoc ? loadLoc : storeLoc);
+    cacheNumber(init);
+
+    SmallVector<PHINode*, 8> phis;
+    SSAUpdater ssa(&phis);
+    SmallPtrSet<Instruction*, 16> insts(accesses.begin(), accesses.end());
+    SmallVector<const Instruction*, 16> list(accesses.begin(), accesses.end());
+    Promoter promoter(list, ssa, AI, exits, insts);
+    ssa.AddAvailableValue(pre, init);
+    promoter.run(accesses);
+
+    for (StoreInst *SI : promoter.sunk) {
+        SI->setDebugLoc(storeLoc);
+        cacheNumber(SI);
+    }
+    if (init->use_empty()) {
+        cache_ids.erase(init);
+        init->eraseFromParent();
+    }
+    ir_changed = true;
+    return true;
+}
+
 /*
  * globalStorePropagation performs global store propagation (GSP) over the basic
  * blocks in the function F. The algorithm for GSP is described on pp. 358-360
@@ -280,7 +1745,7 @@ void StorePropagation::localStorePropagation(Function &F)
 void StorePropagation::globalStorePropagation(Function &F)
 {
     // Build data-flow info.
-    DataFlowAnalysis *dfa = new DataFlowAnalysis(F);
+    DataFlowAnalysis *dfa = new DataFlowAnalysis(F, escapes);
 
     // Run global store propagation on each basic block using its ACP table.
     for (BasicBlock &bb : F) {
@@ -290,6 +1755,7 @@ void StorePropagation::globalStorePropagation(Function &F)
 
     if (verbose)
     {
+        dfa->printACPStats();
         errs() << "post global\n" << F << "\n";
     }
 
@@ -298,6 +1764,85 @@ void StorePropagation::globalStorePropagation(Function &F)
 
 
 
+/*
+ * foldConstants folds every instruction whose operands are all constants,
+ * working from a worklist: only the users of a folded instruction are
+ * revisited. This is plain (pessimistic) constant folding, not sparse
+ * conditional constant propagation: a value that is only constant on the
+ * edges left executable, such as a loop phi, is not found.
+ *
+ * Once no more instructions fold, conditional branches and switches on a
+ * constant are turned into unconditional branches and blocks left
+ * unreachable are deleted. That is done as a separate step because pruning
+ * an edge can delete phis in the successor, which would leave dangling
+ * entries on the worklist; since the pruned phis may make more operands
+ * constant, the two steps alternate until neither changes anything.
+ *
+ * Returns true if the CFG changed.
+ */
+bool StorePropagation::foldConstants(Function &F)
+{
+    const DataLayout &DL = F.getParent()->getDataLayout();
+    bool cfgChanged = false;
+    unsigned nr_folded = 0;
+
+    for (bool pruned = true; pruned; ) {
+        std::vector<Instruction*> worklist;
+        std::set<Instruction*> queued;
+        for (Instruction &I : instructions(F)) {
+            if (I.isTerminator())
+                continue;
+            worklist.push_back(&I);
+            queued.insert(&I);
+        }
+
+        while (!worklist.empty()) {
+            Instruction *I = worklist.back();
+            worklist.pop_back();
+            // Entries of instructions erased while queued are skipped here.
+            if (!queued.erase(I))
+                continue;
+
+            Constant *C = ConstantFoldInstruction(I, DL);
+            if (!C)
+                continue;
+
+            for (User *U : I->users()) {
+                Instruction *UI = cast<Instruction>(U);
+                if (!UI->isTerminator() && queued.insert(UI).second)
+                    worklist.push_back(UI);
+            }
+            I->replaceAllUsesWith(C);
+            nr_folded++;
+
+            if (isInstructionTriviallyDead(I)) {
+                // Leave its worklist entry, if any, to be skipped on pop.
+                queued.erase(I);
+                I->eraseFromParent();
+            }
+        }
+
+        pruned = false;
+        for (BasicBlock &bb : F)
+            pruned |= ConstantFoldTerminator(&bb, true);
+        if (pruned) {
+            removeUnreachableBlocks(F);
+            cfgChanged = true;
+        }
+    }
+
+    ir_changed |= nr_folded || cfgChanged;
+    cfg_changed |= cfgChanged;
+
+    if (verbose)
+    {
+        errs() << "post fold (" << nr_folded << " folded"
+               << (cfgChanged ? ", CFG changed" : "") << ")\n" << F << "\n";
+    }
+
+    return cfgChanged;
+}
+
 /*
  * addCopy is a helper routine for initCopyIdxs. It updates state information
  * to record the index of a single copy instruction
@@ -394,14 +1939,20 @@ void DataFlowAnalysis::initCOPYAndKILLSets(Function &F)
 
     // Precompute the "destination location" for each copy instruction.
     // For arguments, treat the argument itself as its own "location".
-    std::vector<Value*> copyDst(nr_copies, nullptr);
+    copy_dst.assign(nr_copies, nullptr);
+    dsts.clear();
+    clobberable.resize(nr_copies);
+    clobberable.reset();
     for (unsigned i = 0; i < nr_copies; ++i) {
         Value *V = copies[i];
         if (auto *A = dyn_cast<Argument>(V)) {
-            copyDst[i] = A;
+            copy_dst[i] = A;
         } else if (auto *SI = dyn_cast<StoreInst>(V)) {
-            copyDst[i] = SI->getOperand(DST_IDX); // pointer being stored into
+            copy_dst[i] = SI->getOperand(DST_IDX); // pointer being stored into
         }
+        dsts.insert(copy_dst[i]);
+        if (escapes.mayClobber(copy_dst[i]))
+            clobberable.set(i);
     }
 
     // Mark arguments as COPY in the entry block (they reach the end of the entry).
@@ -430,7 +1981,7 @@ void DataFlowAnalysis::initCOPYAndKILLSets(Function &F)
 
                 // This store kills all *other* copies to the same location.
                 for (unsigned ci = 0; ci < nr_copies; ++ci) {
-                    if (copyDst[ci] == loc && (int)ci != thisIdx) {
+                    if (copy_dst[ci] == loc && (int)ci != thisIdx) {
                         bbi->KILL.set(ci);
                     }
                 }
@@ -438,13 +1989,16 @@ void DataFlowAnalysis::initCOPYAndKILLSets(Function &F)
                 // Remember this as the most recent store to 'loc' in this block.
                 lastCopyForLoc[loc] = thisIdx;
             }
-            else if (auto *CB = dyn_cast<CallBase>(&ins)) {
-                // Be conservative: a call may clobber memory.
-                // Kill all copies.
-                for (unsigned ci = 0; ci < nr_copies; ++ci) {
-                    bbi->KILL.set(ci);
+            else if (isClobber(&ins)) {
+                // A call may write any escaped or unknown location; copies
+                // to private allocas survive it.
+                bbi->KILL |= clobberable;
+                for (auto it = lastCopyForLoc.begin(); it != lastCopyForLoc.end(); ) {
+                    if (escapes.mayClobber(it->first))
+                        it = lastCopyForLoc.erase(it);
+                    else
+                        ++it;
                 }
-                lastCopyForLoc.clear();
             }
         }
 
@@ -457,6 +2011,85 @@ void DataFlowAnalysis::initCOPYAndKILLSets(Function &F)
 }
 
 
+/* BitVector only hands out its storage read-only, but the solver updates
+ * CPIn and CPOut in place, word by word. The storage itself is not const.
+ */
+typedef uintptr_t BitWord;
+
+static BitWord *bitWords(BitVector &bv)
+{
+    return const_cast<BitWord*>(bv.getData().data());
+}
+
+/*
+ * transferChunk applies the transfer to the N words at base and returns the
+ * bits that changed. N is a template parameter so that every inner loop has
+ * a constant trip count, which the compiler unrolls and vectorizes for the
+ * target (SSE2 or AVX2 with -march, NEON) or leaves as plain scalar code.
+ */
+template <unsigned N>
+static BitWord transferChunk(BitWord *in, BitWord *out, const BitWord *copy,
+                             const BitWord *kill, const BitWord *const *preds,
+                             unsigned nr_preds, unsigned base)
+{
+    BitWord acc[N];
+
+    if (nr_preds == 0) {
+        for (unsigned w = 0; w < N; ++w)
+            acc[w] = 0;
+    } else {
+        const BitWord *p0 = preds[0] + base;
+        for (unsigned w = 0; w < N; ++w)
+            acc[w] = p0[w];
+        for (unsigned p = 1; p < nr_preds; ++p) {
+            const BitWord *pp = preds[p] + base;
+            for (unsigned w = 0; w < N; ++w)
+                acc[w] &= pp[w];
+        }
+    }
+
+    BitWord *bin = in + base;
+    BitWord *bout = out + base;
+    const BitWord *bcopy = copy + base;
+    const BitWord *bkill = kill + base;
+    BitWord diff = 0;
+    for (unsigned w = 0; w < N; ++w) {
+        BitWord o = bcopy[w] | (acc[w] & ~bkill[w]);
+        diff |= (bin[w] ^ acc[w]) | (bout[w] ^ o);
+        bin[w] = acc[w];
+        bout[w] = o;
+    }
+    return diff;
+}
+
+/*
+ * transferBlock is the fused CPIn/CPOut kernel for one block:
+ *
+ *   CPIn  = AND of CPOut over preds (empty if there are none)
+ *   CPOut = COPY | (CPIn & ~KILL)
+ *
+ * Both sets are written in place and changes are detected in the same pass,
+ * so a solver step allocates nothing and reads each word once. Full chunks
+ * of CHUNK words go through the vectorized transferChunk<CHUNK>; the words
+ * left over at the end are done one at a time.
+ */
+static bool transferBlock(BitWord *in, BitWord *out, const BitWord *copy,
+                          const BitWord *kill, const BitWord *const *preds,
+                          unsigned nr_preds, unsigned nr_words)
+{
+    enum { CHUNK = 16 };
+    BitWord diff = 0;
+    unsigned base = 0;
+
+    for (; base + CHUNK <= nr_words; base += CHUNK)
+        diff |= transferChunk<CHUNK>(in, out, copy, kill, preds, nr_preds,
+                                     base);
+    for (; base < nr_words; ++base)
+        diff |= transferChunk<1>(in, out, copy, kill, preds, nr_preds, base);
+
+    return diff != 0;
+}
+
 /*
  * initCPInAndCPOutSets initializes the CPIn and CPOut sets for each basic
  * block in the function F.
@@ -482,106 +2115,274 @@ void DataFlowAnalysis::initCOPYAndKILLSets(Function &F)
 void DataFlowAnalysis::initCPInAndCPOutSets(Function &F)
 {
     BasicBlock *entry = &F.getEntryBlock();
+    if (nr_copies == 0)
+        return;
+    unsigned nr_words = bb_info[entry]->CPIn.getData().size();
+
+    /* The traversal order and each block's predecessor CPOut words do not
+     * change between iterations, so flatten them once up front.
+     */
+    struct SolverBlock {
+        BitWord       *in;
+        BitWord       *out;
+        const BitWord *copy;
+        const BitWord *kill;
+        unsigned       first_pred;
+        unsigned       nr_preds;
+    };
+    std::vector<SolverBlock> order;
+    std::vector<const BitWord*> pred_words;
 
-    bool changed = true;
+    ReversePostOrderTraversal<Function*> RPOT(&F);
+    for (auto BB = RPOT.begin(); BB != RPOT.end(); ++BB) {
+        BasicBlock *bb = *BB;
+        BasicBlockInfo *bbi = bb_info[bb];
+
+        SolverBlock sb;
+        sb.in = bitWords(bbi->CPIn);
+        sb.out = bitWords(bbi->CPOut);
+        sb.copy = bbi->COPY.getData().data();
+        sb.kill = bbi->KILL.getData().data();
+        sb.first_pred = pred_words.size();
+
+        // Entry has no predecessors: CPIn(entry) = empty set.
+        if (bb != entry)
+            for (BasicBlock *pred : predecessors(bb))
+                pred_words.push_back(bb_info[pred]->CPOut.getData().data());
+
+        sb.nr_preds = pred_words.size() - sb.first_pred;
+        order.push_back(sb);
+    }
 
     // Classic forward data-flow iteration in reverse postorder.
+    bool changed = true;
     while (changed) {
         changed = false;
+        for (SolverBlock &sb : order) {
+            changed |= transferBlock(sb.in, sb.out, sb.copy, sb.kill,
+                                     pred_words.data() + sb.first_pred,
+                                     sb.nr_preds, nr_words);
+        }
+    }
+}
 
-        ReversePostOrderTraversal<Function*> RPOT(&F);
-        for (auto BB = RPOT.begin(); BB != RPOT.end(); ++BB) {
-            BasicBlock *bb = *BB;
-            BasicBlockInfo *bbi = bb_info[bb];
-
-            BitVector oldIn  = bbi->CPIn;
-            BitVector oldOut = bbi->CPOut;
-
-            //  Compute CPIn(bb) 
-            if (bb == entry) {
-                // Entry has no predecessors: CPIn(entry) = empty set.
-                bbi->CPIn.reset();
-            } else {
-                bool firstPred = true;
-                BitVector inBV(nr_copies);
-
-                // CPIn(bb) = intersection of CPOut(pred) over all preds.
-                for (BasicBlock *pred : predecessors(bb)) {
-                    BasicBlockInfo *pinfo = bb_info[pred];
-                    if (firstPred) {
-                        inBV = pinfo->CPOut;
-                        firstPred = false;
-                    } else {
-                        inBV &= pinfo->CPOut;
-                    }
-                }
+/*
+ * resolveCopy returns the value that copy makes available at loc, or null if
+ * copy no longer writes loc (e.g. its pointer operand has been replaced).
+ */
+static Value *resolveCopy(Value *loc, Value *copy)
+{
+    if (!copy)
+        return nullptr;
+    if (auto *SI = dyn_cast<StoreInst>(copy)) {
+        if (SI->getOperand(DST_IDX) != loc)
+            return nullptr;
+        return SI->getOperand(SRC_IDX);
+    }
+    // Degenerate copy: a <- a
+    return copy;
+}
 
-                if (firstPred) {
-                    // No predecessors (unreachable): treat as empty.
-                    bbi->CPIn.reset();
-                } else {
-                    bbi->CPIn = inBV;
-                }
-            }
+void ACPTable::insert(Value *loc, Value *copy)
+{
+    auto it = local.find(loc);
+    if (it != local.end()) {
+        undo_log.push_back({loc, it->second, true});
+        it->second = {copy, gen};
+    } else {
+        undo_log.push_back({loc, {nullptr, 0}, false});
+        local[loc] = {copy, gen};
+    }
+}
 
-            // Compute CPOut(bb) = COPY(bb) ∪ (CPIn(bb) − KILL(bb)) 
-            BitVector notKill = bbi->KILL;
-            notKill.flip();                    // ~KILL
+/*
+ * killClobbered makes every location that a call may write (see EscapeInfo)
+ * unavailable, by starting a new generation.
+ */
+void ACPTable::killClobbered(const EscapeInfo &e)
+{
+    undo_log.push_back({nullptr, {nullptr, gen}, false});
+    gen = ++last_gen;
+    escapes = &e;
+}
 
-            BitVector outBV = bbi->CPIn;       // CPIn
-            outBV &= notKill;                  // CPIn - KILL
-            outBV |= bbi->COPY;                // ∪ COPY
+/*
+ * isLive returns true if an entry for loc made in generation entry_gen
+ * survived the kills since.
+ */
+bool ACPTable::isLive(Value *loc, unsigned entry_gen) const
+{
+    return entry_gen == gen || !escapes->mayClobber(loc);
+}
 
-            bbi->CPOut = outBV;
+void ACPTable::undo(size_t m)
+{
+    while (undo_log.size() > m) {
+        UndoEntry &e = undo_log.back();
+        if (!e.loc)
+            gen = e.entry.gen;
+        else if (e.existed)
+            local[e.loc] = e.entry;
+        else
+            local.erase(e.loc);
+        undo_log.pop_back();
+    }
+}
 
-            if (oldIn != bbi->CPIn || oldOut != bbi->CPOut) {
-                changed = true;
-            }
-        }
+/*
+ * findCopy returns the copy recorded for loc, if any. The copy may no longer
+ * write loc; lookup resolves it to the value that is actually available.
+ */
+Value *ACPTable::findCopy(Value *loc) const
+{
+    auto it = local.find(loc);
+    if (it != local.end())
+        return isLive(loc, it->second.gen) ? it->second.copy : nullptr;
+
+    for (const ACPLayer *layer = base.get(); layer; layer = layer->parent.get()) {
+        auto lit = layer->entries.find(loc);
+        if (lit != layer->entries.end())
+            return isLive(loc, 0) ? lit->second : nullptr;
     }
+    return nullptr;
+}
+
+Value *ACPTable::lookup(Value *loc) const
+{
+    return resolveCopy(loc, findCopy(loc));
+}
+
+std::map<Value*, Value*> ACPTable::flatten() const
+{
+    std::vector<const ACPLayer*> chain;
+    for (const ACPLayer *layer = base.get(); layer; layer = layer->parent.get())
+        chain.push_back(layer);
+
+    // Apply the oldest layer first so that newer entries win.
+    std::map<Value*, LocalEntry> copies;
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it)
+        for (auto &kv : (*it)->entries)
+            copies[kv.first] = {kv.second, 0};
+    for (auto &kv : local)
+        copies[kv.first] = kv.second;
+
+    std::map<Value*, Value*> acp;
+    for (auto &kv : copies)
+        if (isLive(kv.first, kv.second.gen))
+            if (Value *src = resolveCopy(kv.first, kv.second.copy))
+                acp[kv.first] = src;
+    return acp;
 }
 
 /*
- * initACPs creates an ACP table for each basic block, which will be used to
- * conduct global copy propagation.
- *
- * Useful tips:
+ * needsACP returns true if propagating through bb can use an ACP at all: bb
+ * loads from memory or uses a copy's location as an operand. Other blocks
+ * only add their own stores to the table, so they start from an empty one.
+ */
+bool DataFlowAnalysis::needsACP(BasicBlock &bb)
+{
+    for (Instruction &ins : bb) {
+        if (isa<LoadInst>(&ins))
+            return true;
+        for (Value *op : ins.operands())
+            if (dsts.count(op))
+                return true;
+    }
+    return false;
+}
+
+/*
+ * buildACPLayer returns the shared ACP layer for the CPIn of bb (Muchnick
+ * p. 360: the ACP at entry to a block holds the copies in its CPIn).
  *
- * You will need to use CPIn to determine if a copy should be in the ACP for
- * this block.
+ * A block whose CPIn matches one already built reuses that layer. Otherwise
+ * the new layer is built as a delta over the closest layer among the block's
+ * predecessors and the last block built, provided the delta is smaller than
+ * a flat table would be. Chains are kept short, since lookups walk them.
  */
-void DataFlowAnalysis::initACPs()
+std::shared_ptr<const ACPLayer> DataFlowAnalysis::buildACPLayer(BasicBlock &bb)
 {
-    // Use CPIn for each block to seed its ACP table, as in Muchnick’s
-    // global copy propagation (Figure 12.24 + p.360).
-    for (auto &pair : bb_info) {
-        BasicBlockInfo *bbi = pair.second;
-        ACPTable &acp = bbi->ACP;
+    const unsigned MAX_DEPTH = 8;
+    BasicBlockInfo *bbi = bb_info[&bb];
 
-        for (unsigned i = 0; i < nr_copies; ++i) {
-            if (!bbi->CPIn[i]) continue;
+    if (bbi->CPIn.none())
+        return nullptr;
 
-            Value *V = idx_copy[i];
+    auto cached = acp_layers.find(bbi->CPIn);
+    if (cached != acp_layers.end())
+        return cached->second;
 
-            if (auto *A = dyn_cast<Argument>(V)) {
-                // Degenerate copy: a <- a
-                acp[A] = A;
-            } else if (auto *SI = dyn_cast<StoreInst>(V)) {
-                Value *Src = SI->getOperand(SRC_IDX);
-                Value *Dst = SI->getOperand(DST_IDX);
-                acp[Dst] = Src;
-            }
+    std::vector<BasicBlockInfo*> candidates;
+    for (BasicBlock *pred : predecessors(&bb))
+        candidates.push_back(bb_info[pred]);
+    candidates.push_back(last_acp);
+
+    BasicBlockInfo *ref = nullptr;
+    unsigned best = bbi->CPIn.count();
+    for (BasicBlockInfo *cand : candidates) {
+        if (!cand || !cand->ACPBase || cand->ACPBase->depth >= MAX_DEPTH)
+            continue;
+        BitVector diff = cand->CPIn;
+        diff ^= bbi->CPIn;
+        unsigned n = diff.count();
+        if (n < best) {
+            best = n;
+            ref = cand;
         }
     }
+
+    auto layer = std::make_shared<ACPLayer>();
+    layer->depth = 0;
+    if (ref) {
+        layer->parent = ref->ACPBase;
+        layer->depth = ref->ACPBase->depth + 1;
+
+        // Copies that are no longer available, then the new ones, so that
+        // a new copy to the same location wins.
+        BitVector removed = ref->CPIn;
+        removed.reset(bbi->CPIn);
+        for (unsigned i : removed.set_bits())
+            layer->entries[copy_dst[i]] = nullptr;
+
+        BitVector added = bbi->CPIn;
+        added.reset(ref->CPIn);
+        for (unsigned i : added.set_bits())
+            layer->entries[copy_dst[i]] = idx_copy[i];
+    } else {
+        for (unsigned i : bbi->CPIn.set_bits())
+            layer->entries[copy_dst[i]] = idx_copy[i];
+    }
+
+    nr_acp_entries += layer->entries.size();
+    acp_layers[bbi->CPIn] = layer;
+    return layer;
 }
 
+/*
+ * getACP returns the ACP table for bb, building it on first use.
+ */
 ACPTable &DataFlowAnalysis::getACP(BasicBlock &bb)
 {
-    // bb_info was filled in initCOPYAndKILLSets(F) and initACPs().
     BasicBlockInfo *bbi = bb_info[&bb];
+    if (!bbi->hasACP) {
+        if (needsACP(bb)) {
+            bbi->ACPBase = buildACPLayer(bb);
+            if (bbi->ACPBase)
+                last_acp = bbi;
+        }
+        bbi->ACP = ACPTable(bbi->ACPBase);
+        bbi->hasACP = true;
+    }
     return bbi->ACP;
 }
 
+void DataFlowAnalysis::printACPStats()
+{
+    errs() << "ACP: " << acp_layers.size() << " layers, " << nr_acp_entries
+           << " entries for " << bb_info.size() << " blocks x " << nr_copies
+           << " copies\n";
+}
+
 void DataFlowAnalysis::printCopyIdxs()
 {
     errs() << "copy_idx:" << "\n";
@@ -638,7 +2439,8 @@ void DataFlowAnalysis::printDFA()
         errs() << "\n";
 
         errs() << "  ACP:" << "\n";
-        for ( auto it = bbi->ACP.begin(); it != bbi->ACP.end(); ++it )
+        std::map<Value*, Value*> acp = getACP(*it->first).flatten();
+        for ( auto it = acp.begin(); it != acp.end(); ++it )
         {
             rso << *( it->first );
             errs() << "  " << format("%-30s", rso.str().c_str()) << "==  "
@@ -654,16 +2456,22 @@ void DataFlowAnalysis::printDFA()
  *
  * You will not need to modify this routine.
  */
-DataFlowAnalysis::DataFlowAnalysis( Function &F )
+DataFlowAnalysis::DataFlowAnalysis( Function &F, const EscapeInfo &ei )
+    : escapes(ei)
 {
     initCopyIdxs(F);
     initCOPYAndKILLSets(F);
     initCPInAndCPOutSets(F);
-    initACPs();
 
     if (StorePropagation::verbose) {
         errs() << "post DFA" << "\n";
         printCopyIdxs();
         printDFA();
     }
+}
+
+DataFlowAnalysis::~DataFlowAnalysis()
+{
+    for (auto &pair : bb_info)
+        delete pair.second;
 }
\ No newline at end of file